@@ -32,6 +32,26 @@ struct color_node {
         struct color_node *next;
 };
 
+/* Weak reference to a block, cleared once the block becomes unreachable */
+struct dumpster_weak {
+        unsigned long long int hidden; /* Complemented header address, so scans never treat it as a reference */
+        size_t offset; /* Offset of the referenced address within the block */
+        struct dumpster_weak *next;
+        struct dumpster_weak **pprev; /* NULL once the reference has been cleared */
+};
+
+/* Function called with a block that is about to be freed */
+typedef void (*dumpster_finalizer)(void *ptr, void *data);
+
+/* Structure for linked list of blocks with registered finalizers */
+struct final_node {
+        unsigned long long int hidden; /* Complemented header address, so scans never treat it as a reference */
+        size_t offset; /* Offset of the registered address within the block */
+        dumpster_finalizer fn;
+        void *data;
+        struct final_node *next;
+};
+
 /* State data */
 static int initialized = 0;
 static int collecting = 0;
@@ -45,6 +65,11 @@ static void *stack_top;
 static struct color_node *grey_list = NULL;
 static struct color_node *black_list = NULL;
 
+/* Weak references and finalizers, kept outside of the scanned heap */
+static struct dumpster_weak *weak_list = NULL;
+static struct final_node *final_list = NULL;
+static struct final_node *final_queue = NULL;
+
 
 /* Given a pointer, return a tagged pointer */
 static void *tag(void *ptr, unsigned long long int tag) {
@@ -163,12 +188,17 @@ void *dumpster_alloc(size_t alloc_size) {
                         prev->next = cur->next;
                 }
 
+                /*
+                  The tag on a block's next pointer belongs to that block, so leave the head's tag in
+                  place and mark the new block if an incremental cycle is in progress, since it
+                  might never be found by the remaining scans
+                */
                 if (usedp == NULL) {
-                        cur->next = cur;
+                        cur->next = tag(cur, collecting ? BLACK : WHITE);
                         usedp = cur;
                 } else {
-                        cur->next = usedp->next;
-                        usedp->next = cur;
+                        cur->next = tag(untag(usedp->next), collecting ? BLACK : WHITE);
+                        usedp->next = tag(cur, tagof(usedp->next));
                 }
 
                 return cur + 1;
@@ -180,24 +210,49 @@ void *dumpster_alloc(size_t alloc_size) {
 /*
   Given a linked list of memory blocks and a memory address, find the block containing that
   memory address and tag it with a specified color
+
+  Return 1 if the block had not been tagged before, and 0 otherwise
 */
-static void tag_unclean_block(struct header *list, void* memval, enum tags color_tag) {
+static int tag_unclean_block(struct header *list, void* memval, enum tags color_tag) {
         struct header *cur = list;
+        int untagged;
 
         /* No memory blocks to tag */
         if (list == NULL) {
-                return;
+                return 0;
         }
 
         do {
                 /* Tag the block if the memory address is between its bounds */
-                if (list != cur &&
-                    (void*)(cur + 1) <= memval &&
-                    memval <= (void*)(cur + cur->size + 1)) {
+                if ((void*)(cur + 1) <= memval &&
+                    memval < (void*)(cur + cur->size + 1)) {
+                        untagged = tagof(cur->next) == WHITE;
                         cur->next = tag(cur->next, color_tag);
-                        break;
+                        return untagged;
                 }
         } while ((cur = untag(cur->next)) != list);
+
+        return 0;
+}
+
+/*
+  Given a memory address, return the header of the used block containing it, or NULL if the
+  address does not belong to any used block
+*/
+static struct header *find_block(void *memval) {
+        struct header *cur = usedp;
+
+        if (usedp == NULL) {
+                return NULL;
+        }
+
+        do {
+                if ((void*)(cur + 1) <= memval && memval < (void*)(cur + cur->size + 1)) {
+                        return cur;
+                }
+        } while ((cur = untag(cur->next)) != usedp);
+
+        return NULL;
 }
 
 /*
@@ -221,28 +276,38 @@ static void scan_region(void *start, void *end) {
 /*
   Scan the heap (consisting of the list of usedp) for references to blocks in use
   and tag them as such
+
+  A block tagged after its position in the list has been passed would be missed by a single
+  pass, so passes are repeated until one of them tags no new block
 */
 static void scan_heap(void) {
         void *cur;
         void *memval;
         struct header *block, *search;
+        int tagged; /* Whether the current pass has tagged a new block */
 
-        /* Iterate over all blocks in the used block list */
-        for (block = untag(usedp->next); block != usedp; block = untag(block->next)) {
-                /* Skip block if it has already been considered and marked as not-in-use */
-                if (tagof(block->next) == 0) {
-                        continue;
-                }
+        do {
+                tagged = 0;
 
-                /* Iterate over words in block to find any references to blocks to be freed */
-                for (cur = block + 1; cur < (void*)(block + block->size + 1); cur++) {
-                        /* Read a potential address from memory */
-                        memval = *(void**)cur;
+                /* Iterate over all blocks in the used block list, starting with its head */
+                block = usedp;
 
-                        /* Identify the block a memory address belongs to and tag it as in-use */
-                        tag_unclean_block(usedp, memval, BLACK);
-                }
-        }
+                do {
+                        /* Skip block if it has already been considered and marked as not-in-use */
+                        if (tagof(block->next) == 0) {
+                                continue;
+                        }
+
+                        /* Iterate over words in block to find any references to blocks to be freed */
+                        for (cur = block + 1; cur < (void*)(block + block->size + 1); cur++) {
+                                /* Read a potential address from memory */
+                                memval = *(void**)cur;
+
+                                /* Identify the block a memory address belongs to and tag it as in-use */
+                                tagged |= tag_unclean_block(usedp, memval, BLACK);
+                        }
+                } while ((block = untag(block->next)) != usedp);
+        } while (tagged);
 }
 
 /*
@@ -280,6 +345,223 @@ void dumpster_init(void)
         base.size = 0;
 }
 
+/*
+  Create a weak reference to the block containing `ptr`, which does not keep the block alive.
+
+  Returns NULL if `ptr` does not point into a block from `dumpster_alloc()` or the reference
+  could not be allocated.
+*/
+struct dumpster_weak *dumpster_weak_new(void *ptr) {
+        struct dumpster_weak *ref;
+        struct header *block;
+
+        if ((block = find_block(ptr)) == NULL || (ref = malloc(sizeof(*ref))) == NULL) {
+                return NULL;
+        }
+
+        ref->hidden = ~(unsigned long long int)block;
+        ref->offset = (char*)ptr - (char*)(block + 1);
+
+        /* Push the reference onto the front of the list */
+        ref->next = weak_list;
+        ref->pprev = &weak_list;
+        if (weak_list != NULL) {
+                weak_list->pprev = &ref->next;
+        }
+        weak_list = ref;
+
+        return ref;
+}
+
+/*
+  Return the address held by a weak reference, or NULL if its block has been collected
+*/
+void *dumpster_weak_get(struct dumpster_weak *ref) {
+        struct header *block;
+        struct color_node *tmp;
+
+        if (ref == NULL || ref->pprev == NULL) {
+                return NULL;
+        }
+
+        block = (struct header*)~ref->hidden;
+
+        /*
+          An incremental cycle may have already scanned the stack, so shade the block and push it
+          into the linked list of grey blocks for its descendants to be searched as well. If it
+          cannot be queued, abandon the cycle so the next one finds the block on the stack instead.
+        */
+        if (collecting && tagof(block->next) == WHITE) {
+                if ((tmp = malloc(sizeof(*tmp))) == NULL) {
+                        collecting = 0;
+                } else {
+                        block->next = tag(block->next, GREY);
+                        tmp->p = block;
+                        tmp->next = grey_list;
+                        grey_list = tmp;
+                }
+        }
+
+        return (char*)(block + 1) + ref->offset;
+}
+
+/* Remove a weak reference from the list of live references */
+static void unlink_weak(struct dumpster_weak *ref) {
+        *ref->pprev = ref->next;
+        if (ref->next != NULL) {
+                ref->next->pprev = ref->pprev;
+        }
+
+        ref->pprev = NULL;
+}
+
+/*
+  Release a weak reference created by `dumpster_weak_new()`
+*/
+void dumpster_weak_free(struct dumpster_weak *ref) {
+        if (ref == NULL) {
+                return;
+        }
+
+        if (ref->pprev != NULL) {
+                unlink_weak(ref);
+        }
+
+        free(ref);
+}
+
+/*
+  Register `fn` to be called with `ptr` and `data` once the block containing `ptr` is found
+  unreachable. The block and every block reachable from it are kept until the finalizer
+  returns, and are freed by the next collection if they are still unreachable. A block that is
+  reachable from another finalizable block is only finalized once that block has been freed, so
+  finalizable blocks that form a cycle are never finalized. `data` is not scanned and does not
+  keep any block alive.
+
+  Returns 0 on success and -1 if `ptr` does not point into a block from `dumpster_alloc()` or
+  the finalizer could not be registered.
+*/
+int dumpster_register_finalizer(void *ptr, dumpster_finalizer fn, void *data) {
+        struct final_node *node;
+        struct header *block;
+
+        if (fn == NULL || (block = find_block(ptr)) == NULL || (node = malloc(sizeof(*node))) == NULL) {
+                return -1;
+        }
+
+        node->hidden = ~(unsigned long long int)block;
+        node->offset = (char*)ptr - (char*)(block + 1);
+        node->fn = fn;
+        node->data = data;
+        node->next = final_list;
+        final_list = node;
+
+        return 0;
+}
+
+/* Determine whether a block was left unmarked by the most recent marking pass */
+static int is_unmarked(struct header *block) {
+        return tagof(block->next) == WHITE;
+}
+
+/*
+  Mark every unmarked block referenced from the contents of `origin`, ignoring pointers from
+  `origin` to itself so that they do not keep it from being finalized. The blocks reachable
+  from those are left for `scan_heap()` to mark, which needs no memory of its own.
+
+  Return 1 if any block was marked, and 0 otherwise
+*/
+static int mark_children(struct header *origin) {
+        void *cur;
+        struct header *child;
+        int marked = 0;
+
+        /* Iterate over words in block to find references to unmarked blocks */
+        for (cur = origin + 1; cur < (void*)(origin + origin->size + 1); cur++) {
+                child = find_block(*(void**)cur);
+
+                if (child != NULL && child != origin && is_unmarked(child)) {
+                        child->next = tag(child->next, BLACK);
+                        marked = 1;
+                }
+        }
+
+        return marked;
+}
+
+/*
+  Once marking has finished, clear weak references to unmarked blocks, then queue the
+  finalizers of unmarked blocks and mark those blocks, along with everything reachable from
+  them, so they outlive the upcoming sweep
+*/
+static void resolve_weak_and_final(void) {
+        struct dumpster_weak *ref, *next;
+        struct final_node **cur, *node;
+        struct header *block;
+        int marked = 0; /* Whether any block was marked from a finalizable block */
+
+        /* Cleared references are unlinked so they are never inspected again */
+        for (ref = weak_list; ref != NULL; ref = next) {
+                next = ref->next;
+
+                if (is_unmarked((struct header*)~ref->hidden)) {
+                        unlink_weak(ref);
+                }
+        }
+
+        /* Mark everything reachable from unmarked finalizable blocks, but not the blocks themselves */
+        for (node = final_list; node != NULL; node = node->next) {
+                block = (struct header*)~node->hidden;
+
+                if (is_unmarked(block)) {
+                        marked |= mark_children(block);
+                }
+        }
+
+        if (marked) {
+                scan_heap();
+        }
+
+        cur = &final_list;
+
+        /* Finalizable blocks that are still unmarked are unreachable from anything else */
+        while ((node = *cur) != NULL) {
+                if (is_unmarked((struct header*)~node->hidden)) {
+                        /* Move the finalizer from the registered list to the queue */
+                        *cur = node->next;
+                        node->next = final_queue;
+                        final_queue = node;
+                } else {
+                        cur = &node->next;
+                }
+        }
+
+        /* Keep queued blocks alive until their finalizers have run */
+        for (node = final_queue; node != NULL; node = node->next) {
+                block = (struct header*)~node->hidden;
+                block->next = tag(block->next, BLACK);
+        }
+}
+
+/*
+  Run all finalizers queued by the last sweep as a single batch
+*/
+static void run_finalizers(void) {
+        struct final_node *node, *tmp;
+
+        /* Detach the queue so finalizers may safely allocate, collect or register again */
+        node = final_queue;
+        final_queue = NULL;
+
+        while (node != NULL) {
+                node->fn((char*)((struct header*)~node->hidden + 1) + node->offset, node->data);
+
+                tmp = node->next;
+                free(node);
+                node = tmp;
+        }
+}
+
 /*
   Identify orphaned memory blocks and free them using "Mark and Sweep"
 */
@@ -304,6 +586,11 @@ void dumpster_collect(void) {
         /* Scan heap */
         scan_heap();
 
+        /* Only blocks with weak references or finalizers are inspected here */
+        if (weak_list != NULL || final_list != NULL) {
+                resolve_weak_and_final();
+        }
+
         prev = usedp;
         cur = untag(usedp->next);
 
@@ -323,9 +610,32 @@ void dumpster_collect(void) {
 
                         prev->next = tag(cur, tagof(prev->next));
                 } else {
-                        cur = untag(cur->next);
+                        /* Reset the surviving block for the next collection */
+                        cur->next = untag(cur->next);
+                        prev = cur;
+                        cur = cur->next;
                 }
         }
+
+        /* Sweep the head of the used list last, since the loop above stops on reaching it */
+        if (usedp != NULL && tagof(usedp->next) == WHITE) {
+                tmp = usedp;
+
+                if (prev == usedp) {
+                        usedp = NULL;
+                } else {
+                        prev->next = untag(usedp->next);
+                        usedp = prev;
+                }
+
+                add_to_free(tmp);
+        } else if (usedp != NULL) {
+                usedp->next = untag(usedp->next);
+        }
+
+        if (final_queue != NULL) {
+                run_finalizers();
+        }
 }
 
 /*
@@ -333,8 +643,10 @@ void dumpster_collect(void) {
   and tag it and its descendants.
 
   Check that the time limit has not been exceeded while doing so, otherwise return early.
+
+  Return 1 if the block could not be found and queued in time, and 0 otherwise
 */
-static void tag_unclean_block_incremental(struct header *list,
+static int tag_unclean_block_incremental(struct header *list,
                                           void* memval,
                                           struct color_node *new_list,
                                           enum tags color_tag,
@@ -345,30 +657,43 @@ static void tag_unclean_block_incremental(struct header *list,
         /* Iterate over blocks and find the block the address lies between */
         do {
                 if ((void*)(block + 1) <= memval &&
-                    memval <= (void*)(block + block->size + 1)) {
+                    memval < (void*)(block + block->size + 1)) {
+                        /* Blocks that are already marked have been or will be searched */
+                        if (tagof(block->next) != WHITE) {
+                                return 0;
+                        }
+
+                        /* Allocate a new element before tagging, so a block is never grey but unqueued */
+                        if ((tmp = malloc(sizeof(*tmp))) == NULL) {
+                                return 1;
+                        }
+
                         block->next = tag(block->next, color_tag);
 
-                        /* Allocate a new element and push it into the linked list of grey blocks */
-                        tmp = malloc(sizeof(*tmp));
-                        tmp->p = block->next;
+                        /* Push the new element into the linked list of grey blocks */
+                        tmp->p = block;
                         tmp->next = new_list;
                         grey_list = tmp;
-                        break;
+                        return 0;
                 }
 
                 /* Check to ensure tha tthe time limit has not been exceeded */
                 clock_gettime(CLOCK_REALTIME, &cur_time);
 
                 if (cur_time.tv_nsec - start_time.tv_nsec >= MAX_DELAY) {
-                        return;
+                        return 1;
                 }
         } while ((block = untag(block->next)) != list);
+
+        return 0;
 }
 
 /*
   Scan a contiguous memory region for pointers and tag corresponding blocks curerntly in use
+
+  Return 1 if the scan was cut short, and 0 if the whole region was scanned
 */
-static void scan_region_incremental(void *start, void *end, struct timespec start_time) {
+static int scan_region_incremental(void *start, void *end, struct timespec start_time) {
         void *cur; /* Current address in memory being examined */
         void *memval; /* Pointer read from value in memory */
         struct header *block; /* Current block in memory */
@@ -378,37 +703,43 @@ static void scan_region_incremental(void *start, void *end, struct timespec star
                 memval = *(void**)cur;
 
                 /* Iterate through blocks to identify and tag the block an address is from */
-                tag_unclean_block_incremental(usedp, memval, grey_list, GREY, start_time);
+                if (tag_unclean_block_incremental(usedp, memval, grey_list, GREY, start_time)) {
+                        return 1;
+                }
 
                 /* Return early if required */
                 clock_gettime(CLOCK_REALTIME, &cur_time);
 
                 if (cur_time.tv_nsec - start_time.tv_nsec >= MAX_DELAY) {
-                        return;
+                        return 1;
                 }
         }
+
+        return 0;
 }
 
 /*
   Scan the heap (consisting of the list of usedp) for references to blocks in use
   and tag them as such
+
+  Return 1 if the scan was cut short, and 0 once every grey block has been searched
 */
-static void scan_heap_incremental(struct timespec start_time) {
+static int scan_heap_incremental(struct timespec start_time) {
         void *cur;
         void *memval;
         struct header *block, *search;
-        struct color_node *tmp;
+        struct color_node *node;
 
         /* Iterate over all blocks in the used block list */
         while (grey_list != NULL) {
-                /* Skip block if it has already been considered and marked as not-in-use */
-                block = untag(grey_list->p);
-
-                if (tagof(block->next) != BLACK) {
-                        /* Move to the next element in the stack to search */
-                        tmp = grey_list->next;
-                        free(grey_list);
-                        grey_list = tmp;
+                /* Move to the next element in the stack to search, keeping it to be reused */
+                node = grey_list;
+                grey_list = node->next;
+                block = untag(node->p);
+
+                /* Skip block if it has already been searched */
+                if (tagof(block->next) == BLACK) {
+                        free(node);
                         continue;
                 }
 
@@ -418,21 +749,21 @@ static void scan_heap_incremental(struct timespec start_time) {
                         memval = *(void**)cur;
 
                         /* Identify the block a memory address belongs to and tag it as in-use */
-                        tag_unclean_block_incremental(cur, memval, grey_list, GREY, start_time);
+                        if (tag_unclean_block_incremental(usedp, memval, grey_list, GREY, start_time)) {
+                                /* Leave the block grey and push it back to be searched again */
+                                node->next = grey_list;
+                                grey_list = node;
+                                return 1;
+                        }
                 }
 
                 /* Tag the current block once all of its descendants have been searched */
                 block->next = tag(block->next, BLACK);
-                tmp = malloc(sizeof(*tmp));
-                tmp->p = block;
-                tmp->next = black_list;
-                black_list = tmp;
-
-                /* Move to the next element in the stack to search */
-                tmp = grey_list->next;
-                free(grey_list);
-                grey_list = tmp;
+                node->next = black_list;
+                black_list = node;
         }
+
+        return 0;
 }
 
 /*
@@ -446,6 +777,7 @@ static void scan_heap_incremental(struct timespec start_time) {
 */
 void dumpster_collect_incremental() {
         struct header *cur, *prev, *tmp;
+        struct color_node *node;
         extern char end, etext;
         struct timespec start_time;
 
@@ -456,12 +788,19 @@ void dumpster_collect_incremental() {
 
         /* Initialize all blocks to be searched if it's a true new collection cycle */
         if (!collecting) {
-                prev = usedp;
-
-                for (cur = untag(usedp->next); cur != usedp; cur = untag(cur->next)) {
-                        prev->next = tag(cur, WHITE);
+                /* Discard blocks left to search by an abandoned cycle */
+                while (grey_list != NULL) {
+                        node = grey_list->next;
+                        free(grey_list);
+                        grey_list = node;
                 }
 
+                cur = usedp;
+
+                do {
+                        cur->next = untag(cur->next);
+                } while ((cur = cur->next) != usedp);
+
                 collecting = 1;
         }
 
@@ -469,31 +808,34 @@ void dumpster_collect_incremental() {
         clock_gettime(CLOCK_REALTIME, &start_time);
         
         /* Scan data segment */
-        scan_region_incremental(&etext, &end, start_time);
-        clock_gettime(CLOCK_REALTIME, &cur_time);
-
-        if (cur_time.tv_nsec - start_time.tv_nsec >= MAX_DELAY) {
+        if (scan_region_incremental(&etext, &end, start_time)) {
                 return;
         }
+
         /* Move address of RBP into stack_top */
         asm volatile ("mov %%rbp, %0" : "=r" (stack_top));
 
         /* Scan stack */
-        scan_region_incremental(stack_top, stack_base, start_time);
-        clock_gettime(CLOCK_REALTIME, &cur_time);
+        if (scan_region_incremental(stack_top, stack_base, start_time)) {
+                return;
+        }
 
-        if (cur_time.tv_nsec - start_time.tv_nsec >= MAX_DELAY) {
+        /* Scan heap, and only sweep once every grey block has been searched */
+        if (scan_heap_incremental(start_time)) {
                 return;
         }
 
-        /* Scan heap */
-        scan_heap_incremental(start_time);
         clock_gettime(CLOCK_REALTIME, &cur_time);
 
         if (cur_time.tv_nsec - start_time.tv_nsec >= MAX_DELAY) {
                 return;
         }
 
+        /* Only blocks with weak references or finalizers are inspected here */
+        if (weak_list != NULL || final_list != NULL) {
+                resolve_weak_and_final();
+        }
+
         prev = usedp;
         cur = untag(usedp->next);
 
@@ -513,11 +855,34 @@ void dumpster_collect_incremental() {
 
                         prev->next = tag(cur, tagof(prev->next));
                 } else {
-                        cur->next = untag(cur);
+                        /* Reset the surviving block for the next collection */
+                        cur->next = untag(cur->next);
+                        prev = cur;
+                        cur = cur->next;
                 }
         }
 
+        /* Sweep the head of the used list last, since the loop above stops on reaching it */
+        if (usedp != NULL && tagof(usedp->next) == WHITE) {
+                tmp = usedp;
+
+                if (prev == usedp) {
+                        usedp = NULL;
+                } else {
+                        prev->next = untag(usedp->next);
+                        usedp = prev;
+                }
+
+                add_to_free(tmp);
+        } else if (usedp != NULL) {
+                usedp->next = untag(usedp->next);
+        }
+
         collecting = 0;
+
+        if (final_queue != NULL) {
+                run_finalizers();
+        }
 }
 
 /* Compute the fraction of memory that is fragmented between used blocks */
@@ -0,0 +1,75 @@
+#include "dumpster.h"
+#include <stdio.h>
+#include <string.h>
+
+/* Cache entry whose key lives in a separate block */
+struct entry {
+        char *key;
+        int value;
+};
+
+static int finalized = 0;
+
+/* Called once an entry is no longer reachable, before it is freed */
+static void on_evict(void *ptr, void *data) {
+        struct entry *e = ptr;
+
+        finalized++;
+        printf("--- Evicting %s from %s ---\n", e->key, (char*)data);
+}
+
+/* Insert an entry that is only held through a weak reference */
+static struct dumpster_weak *insert(const char *key, int value) {
+        struct entry *e;
+
+        if ((e = dumpster_alloc(sizeof(*e))) == NULL ||
+            (e->key = dumpster_alloc(strlen(key) + 1)) == NULL) {
+                return NULL;
+        }
+
+        strcpy(e->key, key);
+        e->value = value;
+
+        if (dumpster_register_finalizer(e, on_evict, "cache") != 0) {
+                return NULL;
+        }
+
+        return dumpster_weak_new(e);
+}
+
+int main(void) {
+        struct dumpster_weak *ref;
+        struct entry *volatile e; /* Kept in memory so the stack scan sees it */
+
+        dumpster_init();
+
+        if ((ref = insert("answer", 42)) == NULL) {
+                printf("Something went wrong and memory couldn't be allocated...\n");
+                return 1;
+        }
+
+        if ((e = dumpster_weak_get(ref)) != NULL) {
+                printf("--- Cached %s = %d ---\n", e->key, e->value);
+        }
+
+        /* The entry is still referenced from the stack, so it is kept */
+        dumpster_collect();
+        printf("--- Weak reference: %p, finalizers run: %d ---\n", dumpster_weak_get(ref), finalized);
+
+        /* Drop the last strong reference */
+        e = NULL;
+        print_statistics(0);
+
+        /* The entry is unreachable: the weak reference is cleared and the finalizer runs */
+        dumpster_collect();
+        printf("--- Weak reference: %p, finalizers run: %d ---\n", dumpster_weak_get(ref), finalized);
+
+        /* The entry and its key were only kept for the finalizer, so now they are freed */
+        dumpster_collect();
+        printf("--- Finalizers run: %d ---\n", finalized);
+        print_statistics(0);
+
+        dumpster_weak_free(ref);
+
+        return 0;
+}